@@ -5,6 +5,22 @@
 #include <string.h>
 #include <zlib.h>
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define MAP_LOADER_X86_SIMD
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
 // All the typedefs for datafile structures are unchanged...
 typedef struct datafile_item_type_t {
   int type;
@@ -47,9 +63,13 @@ typedef struct datafile_t {
   datafile_info_t info;
   datafile_header_t header;
   int data_start_offset;
-  char **data_ptrs;
   int *data_sizes;
   char *data;
+
+  // scratch buffer and inflate state owned by the map_data_t being loaded
+  void **inflate_buffer;
+  size_t *inflate_capacity;
+  void **inflate_stream;
 } datafile_t;
 
 typedef struct tile_t {
@@ -153,7 +173,7 @@ enum {
   MAPITEMTYPE_SOUND,
 };
 
-static map_data_t parse_map_datafile(datafile_t *data_file);
+static void parse_map_datafile(map_data_t *map_data, datafile_t *data_file);
 
 int get_file_data_size(datafile_t *data_file, int index) {
   if (!data_file) {
@@ -171,6 +191,44 @@ static void swap_endian(void *data, size_t size, size_t num) {
                  ((int_ptr[i] << 8) & 0x00FF0000) | ((int_ptr[i] << 24) & 0xFF000000);
 }
 
+static bool reserve_buffer(void **buffer, size_t *capacity, size_t size) {
+  if (size == 0)
+    size = 1;
+  if (*buffer && *capacity >= size)
+    return true;
+  // the old contents are never needed, so skip the copy realloc would do
+  free(*buffer);
+  *buffer = malloc(size);
+  *capacity = *buffer ? size : 0;
+  return *buffer != NULL;
+}
+
+// like uncompress(), but the inflate state is created once and reused for every item
+static int inflate_data(void **stream_ptr, unsigned char *out, unsigned long *out_size,
+                        const unsigned char *source, unsigned source_size) {
+  z_stream *stream = *stream_ptr;
+  if (!stream) {
+    stream = calloc(1, sizeof(z_stream));
+    if (!stream)
+      return Z_MEM_ERROR;
+    if (inflateInit(stream) != Z_OK) {
+      free(stream);
+      return Z_MEM_ERROR;
+    }
+    *stream_ptr = stream;
+  } else if (inflateReset(stream) != Z_OK) {
+    return Z_STREAM_ERROR;
+  }
+  stream->next_in = (Bytef *)source;
+  stream->avail_in = source_size;
+  stream->next_out = out;
+  stream->avail_out = (uInt)*out_size;
+  const int result = inflate(stream, Z_FINISH);
+  *out_size = stream->total_out;
+  return result == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
+}
+
+// decodes raw data into the shared inflate buffer, the result is only valid until the next call
 void *get_data(datafile_t *data_file, int index) {
   if (!data_file) {
     return NULL;
@@ -178,65 +236,62 @@ void *get_data(datafile_t *data_file, int index) {
   if (index < 0 || index >= data_file->header.num_raw_data) {
     return NULL;
   }
-  if (!data_file->data_ptrs[index]) {
-    if (data_file->data_sizes[index] < 0) {
+  if (data_file->data_sizes[index] < 0) {
+    return NULL;
+  }
+  unsigned data_size = get_file_data_size(data_file, index);
+  unsigned out_size =
+      data_file->header.version == 4 ? (unsigned)data_file->info.data_sizes[index] : data_size;
+  if (!reserve_buffer(data_file->inflate_buffer, data_file->inflate_capacity, out_size)) {
+    data_file->data_sizes[index] = -1;
+    return NULL;
+  }
+  unsigned char *out = *data_file->inflate_buffer;
+
+  unsigned char *data_source = NULL;
+  if (data_file->file) { // Reading from file
+    data_source = malloc(data_size);
+    if (!data_source ||
+        fseek(data_file->file, data_file->data_start_offset + data_file->info.data_offsets[index],
+              SEEK_SET) != 0 ||
+        fread(data_source, 1, data_size, data_file->file) != data_size) {
+      free(data_source);
+      data_file->data_sizes[index] = -1;
       return NULL;
     }
-    unsigned data_size = get_file_data_size(data_file, index);
-#if defined(CONF_ARCH_ENDIAN_BIG)
-    unsigned swap_size = data_size;
-#endif
+  } else { // reading from memory
+    size_t offset = (size_t)data_file->data_start_offset + (size_t)data_file->info.data_offsets[index];
+    if (data_file->info.data_offsets[index] < 0 || offset + data_size > data_file->memory_buffer_size) {
+      data_file->data_sizes[index] = -1;
+      return NULL;
+    }
+    data_source = (unsigned char *)data_file->memory_buffer + offset;
+  }
 
-    unsigned char *data_source = NULL;
-    if (data_file->file) { // Reading from file
-      data_source = malloc(data_size);
-      if (fseek(data_file->file, data_file->data_start_offset + data_file->info.data_offsets[index],
-                SEEK_SET) != 0 ||
-          fread(data_source, 1, data_size, data_file->file) != data_size) {
-        free(data_source);
-        data_file->data_ptrs[index] = NULL;
-        data_file->data_sizes[index] = -1;
-        return NULL;
-      }
-    } else { // reading from memory
-      data_source = (unsigned char *)data_file->memory_buffer + data_file->data_start_offset +
-                    data_file->info.data_offsets[index];
-    }
-
-    if (data_file->header.version == 4) {
-      const unsigned original_uncompressed_size = data_file->info.data_sizes[index];
-      unsigned long uncompressed_size = original_uncompressed_size;
-      data_file->data_ptrs[index] = (char *)malloc(uncompressed_size);
-      data_file->data_sizes[index] = uncompressed_size;
-      const int result = uncompress((Bytef *)data_file->data_ptrs[index], &uncompressed_size,
-                                    (Bytef *)data_source, data_size);
-
-      if (data_file->file)
-        free(data_source); // free temp buffer if we read from file
-
-      if (result != Z_OK || uncompressed_size != original_uncompressed_size) {
-        free(data_file->data_ptrs[index]);
-        data_file->data_ptrs[index] = NULL;
-        data_file->data_sizes[index] = -1;
-        return NULL;
-      }
-#if defined(CONF_ARCH_ENDIAN_BIG)
-      swap_size = uncompressed_size;
-#endif
-    } else {
-      data_file->data_ptrs[index] = (char *)malloc(data_size);
-      data_file->data_sizes[index] = data_size;
-      memcpy(data_file->data_ptrs[index], data_source, data_size);
-      if (data_file->file)
-        free(data_source);
+  if (data_file->header.version == 4) {
+    unsigned long uncompressed_size = out_size;
+    const int result =
+        inflate_data(data_file->inflate_stream, out, &uncompressed_size, data_source, data_size);
+
+    if (data_file->file)
+      free(data_source); // free temp buffer if we read from file
+
+    if (result != Z_OK || uncompressed_size != out_size) {
+      data_file->data_sizes[index] = -1;
+      return NULL;
     }
+  } else {
+    memcpy(out, data_source, data_size);
+    if (data_file->file)
+      free(data_source);
+  }
+  data_file->data_sizes[index] = out_size;
 #if defined(CONF_ARCH_ENDIAN_BIG)
-    if (swap_size) {
-      swap_endian(data_file->data_ptrs[index], sizeof(int), swap_size / sizeof(int));
-    }
-#endif
+  if (out_size) {
+    swap_endian(out, sizeof(int), out_size / sizeof(int));
   }
-  return data_file->data_ptrs[index];
+#endif
+  return out;
 }
 
 void get_type(datafile_t *data_file, int type, int *start, int *num) {
@@ -284,52 +339,383 @@ int get_data_size(datafile_t *data_file, int index) {
   if (index < 0 || index >= data_file->header.num_raw_data) {
     return 0;
   }
-  if (!data_file->data_ptrs[index]) {
-    if (data_file->header.version >= 4) {
-      return data_file->info.data_sizes[index];
-    } else {
-      return get_file_data_size(data_file, index);
+  if (data_file->data_sizes[index] < 0)
+    return 0;
+  if (data_file->header.version >= 4)
+    return data_file->info.data_sizes[index];
+  return get_file_data_size(data_file, index);
+}
+
+// CRC32 and SHA-256 of the map file, fed while the file is read. The x86 paths are picked at runtime,
+// everything else goes through zlib's crc32 and the portable SHA-256 below.
+enum {
+  HASH_CHUNK_SIZE = 1 << 20,
+};
+
+typedef struct map_hasher_t {
+  // picked per hasher, so concurrent loads share no mutable state
+  void (*sha256_blocks)(uint32_t state[8], const unsigned char *data, size_t num_blocks);
+  unsigned (*crc32_update)(unsigned crc, const unsigned char *data, size_t size);
+  unsigned crc;
+  uint32_t state[8];
+  unsigned char block[64];
+  size_t block_size;
+  uint64_t size;
+} map_hasher_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_portable(uint32_t state[8], const unsigned char *data, size_t num_blocks) {
+  for (; num_blocks > 0; --num_blocks, data += 64) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+      w[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) |
+             ((uint32_t)data[i * 4 + 2] << 8) | data[i * 4 + 3];
+    for (int i = 16; i < 64; ++i) {
+      uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
     }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t t1 =
+          h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
   }
-  const int size = data_file->data_sizes[index];
-  if (size < 0)
-    return 0;
-  return size;
 }
 
-map_data_t load_map(const char *name) {
-  FILE *map_file = fopen(name, "rb");
-  if (!map_file) {
-    printf("Could not load map: %s\n", name);
-    return (map_data_t){};
+#undef ROTR32
+
+static unsigned crc32_portable(unsigned crc, const unsigned char *data, size_t size) {
+  return crc32_z(crc, data, size);
+}
+
+#if defined(MAP_LOADER_X86_SIMD)
+__attribute__((target("sha,sse4.1"))) static void sha256_blocks_shani(uint32_t state[8],
+                                                                      const unsigned char *data,
+                                                                      size_t num_blocks) {
+  const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  // the rounds instructions want the state as ABEF and CDGH
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  for (; num_blocks > 0; --num_blocks, data += 64) {
+    const __m128i abef = state0, cdgh = state1;
+    __m128i msg[4];
+    for (int i = 0; i < 16; ++i) {
+      if (i < 4) {
+        msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i * 16)), byte_swap);
+      } else {
+        __m128i w = _mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]);
+        w = _mm_add_epi32(w, _mm_alignr_epi8(msg[(i + 3) & 3], msg[(i + 2) & 3], 4));
+        msg[i & 3] = _mm_sha256msg2_epu32(w, msg[(i + 3) & 3]);
+      }
+      __m128i k = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, k);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(k, 0x0E));
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
   }
 
-  fseek(map_file, 0, SEEK_END);
-  size_t file_size = ftell(map_file);
-  fseek(map_file, 0, SEEK_SET);
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+  _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+__attribute__((target("pclmul,sse4.1"))) static inline __m128i crc32_fold(__m128i x, __m128i k) {
+  return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00));
+}
+
+// Folds 64 bytes per step with carry-less multiplies and reduces with Barrett, see Intel's
+// "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+__attribute__((target("pclmul,sse4.1"))) static unsigned crc32_pclmul(unsigned crc, const unsigned char *data,
+                                                                      size_t size) {
+  if (size < 64)
+    return crc32_portable(crc, data, size);
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  __m128i x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+  __m128i x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+  __m128i x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+  __m128i x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(~crc));
+  const unsigned char *p = data + 64;
+  size_t left = size - 64;
+
+  while (left >= 64) {
+    x1 = _mm_xor_si128(crc32_fold(x1, k1k2), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+    x2 = _mm_xor_si128(crc32_fold(x2, k1k2), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+    x3 = _mm_xor_si128(crc32_fold(x3, k1k2), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+    x4 = _mm_xor_si128(crc32_fold(x4, k1k2), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+    p += 64;
+    left -= 64;
+  }
+
+  // fold the four lanes and the remaining 16 byte blocks into one
+  x1 = _mm_xor_si128(crc32_fold(x1, k3k4), x2);
+  x1 = _mm_xor_si128(crc32_fold(x1, k3k4), x3);
+  x1 = _mm_xor_si128(crc32_fold(x1, k3k4), x4);
+  while (left >= 16) {
+    x1 = _mm_xor_si128(crc32_fold(x1, k3k4), _mm_loadu_si128((const __m128i *)p));
+    p += 16;
+    left -= 16;
+  }
+
+  // 128 to 64 bits, then Barrett reduction to 32 bits
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5, 0x00), x2);
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  crc = ~(unsigned)_mm_extract_epi32(x1, 1);
+  return crc32_portable(crc, p, left);
+}
+#endif
+
+// cpuid is cheap next to hashing a whole map, so it runs for every hasher
+static void select_hash_functions(map_hasher_t *hasher) {
+  hasher->sha256_blocks = sha256_blocks_portable;
+  hasher->crc32_update = crc32_portable;
+#if defined(MAP_LOADER_X86_SIMD)
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+    return;
+  if (ecx & bit_PCLMUL)
+    hasher->crc32_update = crc32_pclmul;
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA))
+    hasher->sha256_blocks = sha256_blocks_shani;
+#endif
+}
+
+static void hasher_init(map_hasher_t *hasher) {
+  select_hash_functions(hasher);
+  static const uint32_t initial_state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  memcpy(hasher->state, initial_state, sizeof(initial_state));
+  hasher->crc = 0;
+  hasher->block_size = 0;
+  hasher->size = 0;
+}
 
-  unsigned char *buffer = malloc(file_size);
-  if (!buffer) {
-    fclose(map_file);
-    return (map_data_t){};
+static void hasher_update(map_hasher_t *hasher, const unsigned char *data, size_t size) {
+  hasher->crc = hasher->crc32_update(hasher->crc, data, size);
+  hasher->size += size;
+  if (hasher->block_size > 0) {
+    size_t fill = 64 - hasher->block_size < size ? 64 - hasher->block_size : size;
+    memcpy(hasher->block + hasher->block_size, data, fill);
+    hasher->block_size += fill;
+    data += fill;
+    size -= fill;
+    if (hasher->block_size < 64)
+      return;
+    hasher->sha256_blocks(hasher->state, hasher->block, 1);
+    hasher->block_size = 0;
   }
+  hasher->sha256_blocks(hasher->state, data, size / 64);
+  memcpy(hasher->block, data + size / 64 * 64, size % 64);
+  hasher->block_size = size % 64;
+}
 
-  if (fread(buffer, file_size, 1, map_file) != 1) {
-    free(buffer);
-    fclose(map_file);
-    return (map_data_t){};
+static void hasher_final(map_hasher_t *hasher, map_data_t *map_data) {
+  // the padding below only belongs to SHA-256
+  map_data->crc = hasher->crc;
+  unsigned char padding[128] = {0x80};
+  size_t padding_size = (hasher->block_size < 56 ? 56 : 120) - hasher->block_size;
+  uint64_t bits = hasher->size * 8;
+  for (int i = 0; i < 8; ++i)
+    padding[padding_size + i] = (unsigned char)(bits >> (56 - i * 8));
+  hasher_update(hasher, padding, padding_size + 8);
+  for (int i = 0; i < 8; ++i) {
+    map_data->sha256[i * 4] = hasher->state[i] >> 24;
+    map_data->sha256[i * 4 + 1] = hasher->state[i] >> 16;
+    map_data->sha256[i * 4 + 2] = hasher->state[i] >> 8;
+    map_data->sha256[i * 4 + 3] = hasher->state[i];
   }
-  fclose(map_file);
+  map_data->has_hashes = true;
+}
 
-  map_data_t map_data = load_map_from_memory(buffer, file_size);
+map_data_t load_map(const char *name) {
+  map_data_t map_data = {0};
+  if (!load_map_into(&map_data, name))
+    free_map_data(&map_data);
   return map_data;
 }
 
 map_data_t load_map_from_memory(unsigned char *buffer, size_t size) {
   map_data_t map_data = {0};
+  if (!load_map_from_memory_into(&map_data, buffer, size)) {
+    free_map_data(&map_data);
+    return map_data;
+  }
+  // the map takes ownership of the buffer, a later load_map_into() reuses it for reading
+  map_data._map_file_data = (void *)buffer;
+  map_data._map_file_size = size;
+  map_data._map_file_capacity = size;
+  return map_data;
+}
+
+static void reset_map_layers(map_data_t *map_data) {
+  memset(&map_data->game_layer, 0, sizeof(map_data->game_layer));
+  memset(&map_data->front_layer, 0, sizeof(map_data->front_layer));
+  memset(&map_data->tele_layer, 0, sizeof(map_data->tele_layer));
+  memset(&map_data->speedup_layer, 0, sizeof(map_data->speedup_layer));
+  memset(&map_data->switch_layer, 0, sizeof(map_data->switch_layer));
+  memset(&map_data->door_layer, 0, sizeof(map_data->door_layer));
+  memset(&map_data->tune_layer, 0, sizeof(map_data->tune_layer));
+  map_data->width = 0;
+  map_data->height = 0;
+  map_data->stride = 0;
+  map_data->border = 0;
+  map_data->_num_dirty_chunks = 0;
+  map_data->num_settings = 0;
+  map_data->settings = NULL;
+  map_data->has_hashes = false;
+  map_data->crc = 0;
+  memset(map_data->sha256, 0, sizeof(map_data->sha256));
+}
+
+static bool load_map_buffer(map_data_t *map_data, const unsigned char *buffer, size_t size);
+
+// plain file descriptors, stdio would allocate a FILE and its buffer on every load
+static int open_map_file(const char *name) {
+#if defined(_WIN32)
+  return _open(name, _O_RDONLY | _O_BINARY);
+#else
+  return open(name, O_RDONLY);
+#endif
+}
+
+static long map_file_size(int fd) {
+#if defined(_WIN32)
+  long size = _lseek(fd, 0, SEEK_END);
+  _lseek(fd, 0, SEEK_SET);
+#else
+  long size = (long)lseek(fd, 0, SEEK_END);
+  lseek(fd, 0, SEEK_SET);
+#endif
+  return size;
+}
+
+static bool read_map_file(int fd, unsigned char *buffer, size_t size) {
+  while (size > 0) {
+#if defined(_WIN32)
+    int result = _read(fd, buffer, (unsigned)size);
+#else
+    ssize_t result = read(fd, buffer, size);
+#endif
+    if (result <= 0)
+      return false;
+    buffer += result;
+    size -= result;
+  }
+  return true;
+}
+
+static void close_map_file(int fd) {
+#if defined(_WIN32)
+  _close(fd);
+#else
+  close(fd);
+#endif
+}
+
+bool load_map_into(map_data_t *map_data, const char *name) {
+  reset_map_layers(map_data);
+  int map_file = open_map_file(name);
+  if (map_file < 0) {
+    printf("Could not load map: %s\n", name);
+    return false;
+  }
+
+  long file_size = map_file_size(map_file);
+  if (file_size <= 0 ||
+      !reserve_buffer(&map_data->_map_file_data, &map_data->_map_file_capacity, (size_t)file_size)) {
+    close_map_file(map_file);
+    return false;
+  }
+  map_data->_map_file_size = file_size;
+
+  // hash in chunks right after reading them, while they are still in cache
+  const bool hash = map_data->load_flags & LOAD_MAP_HASHES;
+  map_hasher_t hasher;
+  if (hash)
+    hasher_init(&hasher);
+  unsigned char *buffer = map_data->_map_file_data;
+  for (size_t offset = 0; offset < (size_t)file_size; offset += HASH_CHUNK_SIZE) {
+    size_t chunk = (size_t)file_size - offset;
+    if (chunk > HASH_CHUNK_SIZE)
+      chunk = HASH_CHUNK_SIZE;
+    if (!read_map_file(map_file, buffer + offset, chunk)) {
+      close_map_file(map_file);
+      return false;
+    }
+    if (hash)
+      hasher_update(&hasher, buffer + offset, chunk);
+  }
+  close_map_file(map_file);
+  if (hash)
+    hasher_final(&hasher, map_data);
+
+  return load_map_buffer(map_data, buffer, map_data->_map_file_size);
+}
+
+bool load_map_from_memory_into(map_data_t *map_data, const unsigned char *buffer, size_t size) {
+  reset_map_layers(map_data);
+  if (map_data->load_flags & LOAD_MAP_HASHES) {
+    map_hasher_t hasher;
+    hasher_init(&hasher);
+    hasher_update(&hasher, buffer, size);
+    hasher_final(&hasher, map_data);
+  }
+  return load_map_buffer(map_data, buffer, size);
+}
+
+static bool load_map_buffer(map_data_t *map_data, const unsigned char *buffer, size_t size) {
   if (size < sizeof(datafile_header_t)) {
     printf("Invalid map data: too small\n");
-    return map_data;
+    return false;
   }
 
   datafile_header_t file_header;
@@ -344,30 +730,29 @@ map_data_t load_map_from_memory(unsigned char *buffer, size_t size) {
 
   unsigned alloc_size = info_size;
   alloc_size += sizeof(datafile_t);
-  alloc_size += file_header.num_raw_data * sizeof(void *);
   alloc_size += file_header.num_raw_data * sizeof(int);
 
-  if (info_size > size || file_header.num_item_types < 0 || file_header.num_items < 0 ||
-      file_header.num_raw_data < 0 || file_header.item_size < 0) {
+  if (info_size > size - sizeof(datafile_header_t) || file_header.num_item_types < 0 ||
+      file_header.num_items < 0 || file_header.num_raw_data < 0 || file_header.item_size < 0) {
     printf("Invalid map signature\n");
-    return map_data;
+    return false;
   }
 
-  datafile_t *tmp_data_file = (datafile_t *)malloc(alloc_size);
-  if (!tmp_data_file) {
-    return map_data;
-  }
+  if (!reserve_buffer(&map_data->_info_buffer, &map_data->_info_capacity, alloc_size))
+    return false;
+  datafile_t *tmp_data_file = (datafile_t *)map_data->_info_buffer;
 
   tmp_data_file->file = NULL; // Mark as memory-based
   tmp_data_file->memory_buffer = buffer;
   tmp_data_file->memory_buffer_size = size;
   tmp_data_file->header = file_header;
   tmp_data_file->data_start_offset = sizeof(datafile_header_t) + info_size;
-  tmp_data_file->data_ptrs = (char **)(tmp_data_file + 1);
-  tmp_data_file->data_sizes = (int *)(tmp_data_file->data_ptrs + file_header.num_raw_data);
+  tmp_data_file->data_sizes = (int *)(tmp_data_file + 1);
   tmp_data_file->data = (char *)(tmp_data_file->data_sizes + file_header.num_raw_data);
+  tmp_data_file->inflate_buffer = &map_data->_inflate_buffer;
+  tmp_data_file->inflate_stream = &map_data->_inflate_stream;
+  tmp_data_file->inflate_capacity = &map_data->_inflate_capacity;
 
-  memset(tmp_data_file->data_ptrs, 0, file_header.num_raw_data * sizeof(void *));
   memset(tmp_data_file->data_sizes, 0, file_header.num_raw_data * sizeof(int));
 
   memcpy(tmp_data_file->data, buffer + sizeof(datafile_header_t), info_size);
@@ -385,20 +770,215 @@ map_data_t load_map_from_memory(unsigned char *buffer, size_t size) {
         (char *)&tmp_data_file->info.data_offsets[tmp_data_file->header.num_raw_data];
   tmp_data_file->info.data_start = tmp_data_file->info.item_start + tmp_data_file->header.item_size;
 
-  map_data = parse_map_datafile(tmp_data_file);
+  parse_map_datafile(map_data, tmp_data_file);
+  return map_data->game_layer.data != NULL;
+}
 
-  for (int i = 0; i < tmp_data_file->header.num_raw_data; i++) {
-    free(tmp_data_file->data_ptrs[i]);
+static void *get_plane(const map_data_t *map_data, int plane) {
+  switch (plane) {
+  case PLANE_GAME_DATA:
+    return map_data->game_layer.data;
+  case PLANE_GAME_FLAGS:
+    return map_data->game_layer.flags;
+  case PLANE_FRONT_DATA:
+    return map_data->front_layer.data;
+  case PLANE_FRONT_FLAGS:
+    return map_data->front_layer.flags;
+  case PLANE_TELE_NUMBER:
+    return map_data->tele_layer.number;
+  case PLANE_TELE_TYPE:
+    return map_data->tele_layer.type;
+  case PLANE_SPEEDUP_FORCE:
+    return map_data->speedup_layer.force;
+  case PLANE_SPEEDUP_MAX_SPEED:
+    return map_data->speedup_layer.max_speed;
+  case PLANE_SPEEDUP_TYPE:
+    return map_data->speedup_layer.type;
+  case PLANE_SPEEDUP_ANGLE:
+    return map_data->speedup_layer.angle;
+  case PLANE_SWITCH_NUMBER:
+    return map_data->switch_layer.number;
+  case PLANE_SWITCH_TYPE:
+    return map_data->switch_layer.type;
+  case PLANE_SWITCH_FLAGS:
+    return map_data->switch_layer.flags;
+  case PLANE_SWITCH_DELAY:
+    return map_data->switch_layer.delay;
+  case PLANE_TUNE_NUMBER:
+    return map_data->tune_layer.number;
+  case PLANE_TUNE_TYPE:
+    return map_data->tune_layer.type;
   }
-  free(tmp_data_file);
+  return NULL;
+}
 
-  map_data._map_file_data = (void *)buffer; // store the original buffer pointer
-  map_data._map_file_size = size;
-  return map_data;
+static void set_plane(map_data_t *map_data, int plane, void *data) {
+  switch (plane) {
+  case PLANE_GAME_DATA:
+    map_data->game_layer.data = data;
+    break;
+  case PLANE_GAME_FLAGS:
+    map_data->game_layer.flags = data;
+    break;
+  case PLANE_FRONT_DATA:
+    map_data->front_layer.data = data;
+    break;
+  case PLANE_FRONT_FLAGS:
+    map_data->front_layer.flags = data;
+    break;
+  case PLANE_TELE_NUMBER:
+    map_data->tele_layer.number = data;
+    break;
+  case PLANE_TELE_TYPE:
+    map_data->tele_layer.type = data;
+    break;
+  case PLANE_SPEEDUP_FORCE:
+    map_data->speedup_layer.force = data;
+    break;
+  case PLANE_SPEEDUP_MAX_SPEED:
+    map_data->speedup_layer.max_speed = data;
+    break;
+  case PLANE_SPEEDUP_TYPE:
+    map_data->speedup_layer.type = data;
+    break;
+  case PLANE_SPEEDUP_ANGLE:
+    map_data->speedup_layer.angle = data;
+    break;
+  case PLANE_SWITCH_NUMBER:
+    map_data->switch_layer.number = data;
+    break;
+  case PLANE_SWITCH_TYPE:
+    map_data->switch_layer.type = data;
+    break;
+  case PLANE_SWITCH_FLAGS:
+    map_data->switch_layer.flags = data;
+    break;
+  case PLANE_SWITCH_DELAY:
+    map_data->switch_layer.delay = data;
+    break;
+  case PLANE_TUNE_NUMBER:
+    map_data->tune_layer.number = data;
+    break;
+  case PLANE_TUNE_TYPE:
+    map_data->tune_layer.type = data;
+    break;
+  }
 }
 
-static map_data_t parse_map_datafile(datafile_t *tmp_data_file) {
-  map_data_t map_data = {0};
+static int plane_elem_size(int plane) { return plane == PLANE_SPEEDUP_ANGLE ? sizeof(short) : 1; }
+
+static int padding_border(const map_padding_t *padding) { return padding->border > 0 ? padding->border : 0; }
+
+static int padded_stride(const map_padding_t *padding, int width) {
+  int stride = width + 2 * padding_border(padding);
+  if (padding->alignment > 1)
+    stride = (stride + padding->alignment - 1) / padding->alignment * padding->alignment;
+  return stride;
+}
+
+static int map_stride(const map_data_t *map_data) {
+  return map_data->stride > 0 ? map_data->stride : map_data->width;
+}
+
+// the plane is filled densely first and spread into the padded layout by finish_planes()
+static void *reserve_plane(map_data_t *map_data, int plane, int width, int height) {
+  const int border = padding_border(&map_data->padding);
+  size_t size = (size_t)padded_stride(&map_data->padding, width) * (height + 2 * border);
+  size *= plane_elem_size(plane);
+  if (!reserve_buffer(&map_data->_planes[plane], &map_data->_plane_capacities[plane], size))
+    return NULL;
+  return map_data->_planes[plane];
+}
+
+static void fill_values(unsigned char *dst, int elem_size, const unsigned char *value, int count) {
+  if (elem_size == 1) {
+    memset(dst, *value, count);
+    return;
+  }
+  for (int i = 0; i < count; ++i)
+    memcpy(dst + i * elem_size, value, elem_size);
+}
+
+static unsigned char *pad_plane(unsigned char *buffer, int elem_size, int width, int height,
+                                const map_padding_t *padding) {
+  const int border = padding_border(padding), stride = padded_stride(padding, width);
+  const size_t row_size = (size_t)stride * elem_size;
+  unsigned char *base = buffer + ((size_t)border * stride + border) * elem_size;
+  // moving the last row first never overwrites rows that still have to be moved
+  for (int y = height - 1; y >= 0; --y)
+    memmove(base + y * row_size, buffer + (size_t)y * width * elem_size, (size_t)width * elem_size);
+
+  const int right = stride - border - width;
+  for (int y = 0; y < height; ++y) {
+    unsigned char *row = base + y * row_size;
+    const unsigned char *left_value = row, *right_value = row + (size_t)(width - 1) * elem_size;
+    if (!padding->clamp)
+      left_value = right_value = (const unsigned char *)&padding->fill[0];
+    fill_values(row - (size_t)border * elem_size, elem_size, left_value, border);
+    fill_values(row + (size_t)width * elem_size, elem_size, right_value, right);
+  }
+  for (int y = 1; y <= border; ++y) {
+    unsigned char *top = base - y * row_size - (size_t)border * elem_size;
+    unsigned char *bottom = base + (height - 1 + y) * row_size - (size_t)border * elem_size;
+    if (padding->clamp) {
+      memcpy(top, base - (size_t)border * elem_size, row_size);
+      memcpy(bottom, base + (height - 1) * row_size - (size_t)border * elem_size, row_size);
+    } else {
+      fill_values(top, elem_size, (const unsigned char *)&padding->fill[0], stride);
+      fill_values(bottom, elem_size, (const unsigned char *)&padding->fill[0], stride);
+    }
+  }
+  return base;
+}
+
+static int dirty_chunk_count(int tiles) {
+  return (tiles + MAP_DIRTY_CHUNK_SIZE - 1) >> MAP_DIRTY_CHUNK_SHIFT;
+}
+
+// also sizes the dirty chunk buffers, so edits never allocate; on failure the layers are reset
+static bool finish_planes(map_data_t *map_data) {
+  const map_padding_t *padding = &map_data->padding;
+  if (!map_data->game_layer.data) {
+    map_data->stride = map_data->border = 0;
+    return true;
+  }
+  const int num_chunks = dirty_chunk_count(map_data->width) * dirty_chunk_count(map_data->height);
+  if (!reserve_buffer((void **)&map_data->_dirty_chunks, &map_data->_dirty_chunks_capacity, num_chunks) ||
+      !reserve_buffer((void **)&map_data->_dirty_chunk_list, &map_data->_dirty_chunk_list_capacity,
+                      num_chunks * sizeof(int))) {
+    reset_map_layers(map_data);
+    return false;
+  }
+  // a new map invalidates everything derived from the previous one
+  memset(map_data->_dirty_chunks, 1, num_chunks);
+  for (int i = 0; i < num_chunks; ++i)
+    map_data->_dirty_chunk_list[i] = i;
+  map_data->_num_dirty_chunks = num_chunks;
+
+  map_data->stride = padded_stride(padding, map_data->width);
+  map_data->border = padding_border(padding);
+  if (map_data->stride == map_data->width)
+    return true;
+  for (int p = 0; p < NUM_PLANES; ++p) {
+    unsigned char *plane = get_plane(map_data, p);
+    if (!plane)
+      continue;
+    map_padding_t plane_padding = *padding;
+    // fill values are stored in the plane's own type so pad_plane() can copy their bytes
+    if (plane_elem_size(p) == 1) {
+      unsigned char fill = padding->fill[p];
+      memcpy(&plane_padding.fill[0], &fill, 1);
+    } else {
+      short fill = padding->fill[p];
+      memcpy(&plane_padding.fill[0], &fill, sizeof(short));
+    }
+    plane = pad_plane(plane, plane_elem_size(p), map_data->width, map_data->height, &plane_padding);
+    set_plane(map_data, p, plane);
+  }
+  return true;
+}
+
+static void parse_map_datafile(map_data_t *map_data, datafile_t *tmp_data_file) {
   int groups_num, groups_start, layers_num, layers_start;
   get_type(tmp_data_file, MAPITEMTYPE_GROUP, &groups_start, &groups_num);
   get_type(tmp_data_file, MAPITEMTYPE_LAYER, &layers_start, &layers_num);
@@ -409,107 +989,123 @@ static map_data_t parse_map_datafile(datafile_t *tmp_data_file) {
       if (layer->type != 2)
         continue;
       map_item_layer_tilemap_t *tilemap = (map_item_layer_tilemap_t *)layer;
-      int size = tilemap->width * tilemap->height;
+      const int width = tilemap->width, height = tilemap->height;
+      int size = width * height;
       if (tilemap->flags & TILESLAYERFLAG_GAME) {
         tile_t *tiles = get_data(tmp_data_file, tilemap->data);
         if (tiles) {
-          unsigned char *new_data = malloc(size);
-          unsigned char *new_flags = malloc(size);
+          unsigned char *new_data = reserve_plane(map_data, PLANE_GAME_DATA, width, height);
+          unsigned char *new_flags = reserve_plane(map_data, PLANE_GAME_FLAGS, width, height);
+          if (!new_data || !new_flags)
+            continue;
           for (int i = 0; i < size; ++i) {
             new_data[i] = tiles[i].index;
             new_flags[i] = tiles[i].flags;
           }
-          map_data.game_layer.data = new_data;
-          map_data.game_layer.flags = new_flags;
-          map_data.width = tilemap->width;
-          map_data.height = tilemap->height;
+          map_data->game_layer.data = new_data;
+          map_data->game_layer.flags = new_flags;
+          map_data->width = tilemap->width;
+          map_data->height = tilemap->height;
         }
         continue;
       }
       if (tilemap->flags & TILESLAYERFLAG_FRONT) {
         tile_t *tiles = get_data(tmp_data_file, tilemap->front);
         if (tiles) {
-          unsigned char *new_data = malloc(size);
-          unsigned char *new_flags = malloc(size);
+          unsigned char *new_data = reserve_plane(map_data, PLANE_FRONT_DATA, width, height);
+          unsigned char *new_flags = reserve_plane(map_data, PLANE_FRONT_FLAGS, width, height);
+          if (!new_data || !new_flags)
+            continue;
           for (int i = 0; i < size; ++i) {
             new_data[i] = tiles[i].index;
             new_flags[i] = tiles[i].flags;
           }
-          map_data.front_layer.data = new_data;
-          map_data.front_layer.flags = new_flags;
+          map_data->front_layer.data = new_data;
+          map_data->front_layer.flags = new_flags;
         }
         continue;
       }
       if (tilemap->flags & TILESLAYERFLAG_TELE) {
         tele_tile_t *tiles = get_data(tmp_data_file, tilemap->tele);
         if (tiles) {
-          unsigned char *new_type = malloc(size);
-          unsigned char *new_number = malloc(size);
+          unsigned char *new_type = reserve_plane(map_data, PLANE_TELE_TYPE, width, height);
+          unsigned char *new_number = reserve_plane(map_data, PLANE_TELE_NUMBER, width, height);
+          if (!new_type || !new_number)
+            continue;
           for (int i = 0; i < size; ++i) {
             new_type[i] = tiles[i].type;
             new_number[i] = tiles[i].number;
           }
-          map_data.tele_layer.type = new_type;
-          map_data.tele_layer.number = new_number;
+          map_data->tele_layer.type = new_type;
+          map_data->tele_layer.number = new_number;
         }
         continue;
       }
       if (tilemap->flags & TILESLAYERFLAG_SPEEDUP) {
         speedup_tile_t *tiles = get_data(tmp_data_file, tilemap->speedup);
         if (tiles) {
-          unsigned char *new_force = malloc(size);
-          unsigned char *new_max_speed = malloc(size);
-          unsigned char *new_type = malloc(size);
-          short *new_angle = malloc(size * sizeof(short));
+          unsigned char *new_force = reserve_plane(map_data, PLANE_SPEEDUP_FORCE, width, height);
+          unsigned char *new_max_speed = reserve_plane(map_data, PLANE_SPEEDUP_MAX_SPEED, width, height);
+          unsigned char *new_type = reserve_plane(map_data, PLANE_SPEEDUP_TYPE, width, height);
+          short *new_angle = reserve_plane(map_data, PLANE_SPEEDUP_ANGLE, width, height);
+          if (!new_force || !new_max_speed || !new_type || !new_angle)
+            continue;
           for (int i = 0; i < size; ++i) {
             new_force[i] = tiles[i].force;
             new_max_speed[i] = tiles[i].max_speed;
             new_type[i] = tiles[i].type;
             new_angle[i] = tiles[i].angle;
           }
-          map_data.speedup_layer.force = new_force;
-          map_data.speedup_layer.max_speed = new_max_speed;
-          map_data.speedup_layer.type = new_type;
-          map_data.speedup_layer.angle = new_angle;
+          map_data->speedup_layer.force = new_force;
+          map_data->speedup_layer.max_speed = new_max_speed;
+          map_data->speedup_layer.type = new_type;
+          map_data->speedup_layer.angle = new_angle;
         }
         continue;
       }
       if (tilemap->flags & TILESLAYERFLAG_SWITCH) {
         switch_tile_t *tiles = get_data(tmp_data_file, tilemap->switch_);
         if (tiles) {
-          unsigned char *new_type = malloc(size);
-          unsigned char *new_number = malloc(size);
-          unsigned char *new_flags = malloc(size);
-          unsigned char *new_delay = malloc(size);
+          unsigned char *new_type = reserve_plane(map_data, PLANE_SWITCH_TYPE, width, height);
+          unsigned char *new_number = reserve_plane(map_data, PLANE_SWITCH_NUMBER, width, height);
+          unsigned char *new_flags = reserve_plane(map_data, PLANE_SWITCH_FLAGS, width, height);
+          unsigned char *new_delay = reserve_plane(map_data, PLANE_SWITCH_DELAY, width, height);
+          if (!new_type || !new_number || !new_flags || !new_delay)
+            continue;
           for (int i = 0; i < size; ++i) {
             new_type[i] = tiles[i].type;
             new_number[i] = tiles[i].number;
             new_flags[i] = tiles[i].flags;
             new_delay[i] = tiles[i].delay;
           }
-          map_data.switch_layer.type = new_type;
-          map_data.switch_layer.number = new_number;
-          map_data.switch_layer.flags = new_flags;
-          map_data.switch_layer.delay = new_delay;
+          map_data->switch_layer.type = new_type;
+          map_data->switch_layer.number = new_number;
+          map_data->switch_layer.flags = new_flags;
+          map_data->switch_layer.delay = new_delay;
         }
         continue;
       }
       if (tilemap->flags & TILESLAYERFLAG_TUNE) {
         tune_tile_t *tiles = get_data(tmp_data_file, tilemap->tune);
         if (tiles) {
-          unsigned char *new_type = malloc(size);
-          unsigned char *new_number = malloc(size);
+          unsigned char *new_type = reserve_plane(map_data, PLANE_TUNE_TYPE, width, height);
+          unsigned char *new_number = reserve_plane(map_data, PLANE_TUNE_NUMBER, width, height);
+          if (!new_type || !new_number)
+            continue;
           for (int i = 0; i < size; ++i) {
             new_type[i] = tiles[i].type;
             new_number[i] = tiles[i].number;
           }
-          map_data.tune_layer.type = new_type;
-          map_data.tune_layer.number = new_number;
+          map_data->tune_layer.type = new_type;
+          map_data->tune_layer.number = new_number;
         }
         continue;
       }
     }
   }
+  if (!finish_planes(map_data))
+    return;
+
   int info_num, info_start;
   get_type(tmp_data_file, MAPITEMTYPE_INFO, &info_start, &info_num);
   for (int i = info_start; i < info_start + info_num; i++) {
@@ -524,56 +1120,787 @@ static map_data_t parse_map_datafile(datafile_t *tmp_data_file) {
       break;
     int size = get_data_size(tmp_data_file, item->settings);
     char *settings = (char *)get_data(tmp_data_file, item->settings);
+    if (!settings)
+      break;
+    // the strings are copied in one block, settings[] points into it
+    if (!reserve_buffer((void **)&map_data->_settings_data, &map_data->_settings_data_capacity, size + 1))
+      break;
+    memcpy(map_data->_settings_data, settings, size);
+    map_data->_settings_data[size] = '\0';
+    settings = map_data->_settings_data;
+    int num_settings = 0;
     char *next = settings;
-    map_data.num_settings = 0;
     while (next < settings + size) {
       int str_size = strlen(next) + 1;
       next += str_size;
-      ++map_data.num_settings;
+      ++num_settings;
     }
-    map_data.settings = malloc(map_data.num_settings * sizeof(void *));
+    if (!reserve_buffer((void **)&map_data->_settings_list, &map_data->_settings_list_capacity,
+                        num_settings * sizeof(void *)))
+      break;
     next = settings;
     int a = 0;
     while (next < settings + size) {
       int str_size = strlen(next) + 1;
-      map_data.settings[a] = malloc(str_size);
-      strcpy(map_data.settings[a], next);
+      map_data->_settings_list[a] = next;
       ++a;
       next += str_size;
     }
+    map_data->num_settings = num_settings;
+    map_data->settings = map_data->_settings_list;
     break;
   }
-  return map_data;
 }
 
 void free_map_data(map_data_t *map_data) {
   if (map_data == NULL)
     return;
-  // free the main map file buffer if it was loaded from a file
-  if (map_data->_map_file_data) {
-    free(map_data->_map_file_data);
-  }
-  free(map_data->game_layer.data);
-  free(map_data->game_layer.flags);
-  free(map_data->front_layer.data);
-  free(map_data->front_layer.flags);
-  free(map_data->tele_layer.number);
-  free(map_data->tele_layer.type);
-  free(map_data->speedup_layer.force);
-  free(map_data->speedup_layer.max_speed);
-  free(map_data->speedup_layer.type);
-  free(map_data->speedup_layer.angle);
-  free(map_data->switch_layer.number);
-  free(map_data->switch_layer.type);
-  free(map_data->switch_layer.flags);
-  free(map_data->switch_layer.delay);
-  free(map_data->door_layer.index);
-  free(map_data->door_layer.flags);
-  free(map_data->door_layer.number);
-  free(map_data->tune_layer.number);
-  free(map_data->tune_layer.type);
-  for (int i = 0; i < map_data->num_settings; ++i)
-    free(map_data->settings[i]);
-  free(map_data->settings);
+  // the layer pointers alias the plane buffers, so only the owned buffers are freed
+  free(map_data->_map_file_data);
+  for (int i = 0; i < NUM_PLANES; ++i)
+    free(map_data->_planes[i]);
+  free(map_data->_inflate_buffer);
+  if (map_data->_inflate_stream) {
+    inflateEnd(map_data->_inflate_stream);
+    free(map_data->_inflate_stream);
+  }
+  free(map_data->_info_buffer);
+  free(map_data->_settings_list);
+  free(map_data->_settings_data);
+  free(map_data->_dirty_chunks);
+  free(map_data->_dirty_chunk_list);
   memset(map_data, 0, sizeof(map_data_t));
 }
+
+static bool clip_rect(const map_data_t *map_data, map_rect_t *rect) {
+  if (rect->x0 < 0)
+    rect->x0 = 0;
+  if (rect->y0 < 0)
+    rect->y0 = 0;
+  if (rect->x1 > map_data->width)
+    rect->x1 = map_data->width;
+  if (rect->y1 > map_data->height)
+    rect->y1 = map_data->height;
+  return rect->x0 < rect->x1 && rect->y0 < rect->y1;
+}
+
+// Dirty tiles are tracked per chunk of MAP_DIRTY_CHUNK_SIZE x MAP_DIRTY_CHUNK_SIZE tiles, so scattered
+// edits stay scattered. Each chunk is listed once, when its flag is first set.
+static void add_dirty_rect(map_data_t *map_data, const map_rect_t *rect) {
+  const int chunks_x = dirty_chunk_count(map_data->width);
+  unsigned char *dirty = map_data->_dirty_chunks;
+  for (int cy = rect->y0 >> MAP_DIRTY_CHUNK_SHIFT; cy <= (rect->y1 - 1) >> MAP_DIRTY_CHUNK_SHIFT; ++cy) {
+    for (int cx = rect->x0 >> MAP_DIRTY_CHUNK_SHIFT; cx <= (rect->x1 - 1) >> MAP_DIRTY_CHUNK_SHIFT; ++cx) {
+      const int chunk = cy * chunks_x + cx;
+      if (dirty[chunk])
+        continue;
+      dirty[chunk] = 1;
+      map_data->_dirty_chunk_list[map_data->_num_dirty_chunks++] = chunk;
+    }
+  }
+}
+
+static void write_tile(map_data_t *map_data, int plane, int index, int value) {
+  void *data = get_plane(map_data, plane);
+  if (plane_elem_size(plane) == 1)
+    ((unsigned char *)data)[index] = value;
+  else
+    ((short *)data)[index] = value;
+}
+
+// clamped guard tiles copy the map edge, so edits on the edge have to be repeated into them
+static void refresh_guards(map_data_t *map_data, int plane, const map_rect_t *rect) {
+  const int width = map_data->width, height = map_data->height, border = map_data->border;
+  const int stride = map_stride(map_data);
+  if (!map_data->padding.clamp || (border == 0 && stride == width))
+    return;
+  map_rect_t box = *rect;
+  if (box.x0 == 0)
+    box.x0 = -border;
+  if (box.x1 == width)
+    box.x1 = stride - border;
+  if (box.y0 == 0)
+    box.y0 = -border;
+  if (box.y1 == height)
+    box.y1 = height + border;
+  const unsigned char *data = get_plane(map_data, plane);
+  const int elem_size = plane_elem_size(plane);
+  for (int y = box.y0; y < box.y1; ++y) {
+    const int src_y = y < 0 ? 0 : y >= height ? height - 1 : y;
+    for (int x = box.x0; x < box.x1; ++x) {
+      if (x >= 0 && x < width && y >= 0 && y < height)
+        continue;
+      const int src_x = x < 0 ? 0 : x >= width ? width - 1 : x;
+      memcpy((unsigned char *)data + ((ptrdiff_t)y * stride + x) * elem_size,
+             data + ((ptrdiff_t)src_y * stride + src_x) * elem_size, elem_size);
+    }
+  }
+}
+
+bool map_set_tile(map_data_t *map_data, int plane, int x, int y, int value) {
+  if (plane < 0 || plane >= NUM_PLANES || !get_plane(map_data, plane))
+    return false;
+  if (x < 0 || y < 0 || x >= map_data->width || y >= map_data->height)
+    return false;
+  const map_rect_t rect = {x, y, x + 1, y + 1};
+  write_tile(map_data, plane, y * map_stride(map_data) + x, value);
+  refresh_guards(map_data, plane, &rect);
+  add_dirty_rect(map_data, &rect);
+  return true;
+}
+
+void map_fill_tiles(map_data_t *map_data, int plane, const map_rect_t *rect, int value) {
+  map_rect_t clipped = *rect;
+  if (plane < 0 || plane >= NUM_PLANES || !get_plane(map_data, plane) || !clip_rect(map_data, &clipped))
+    return;
+  const int stride = map_stride(map_data);
+  for (int y = clipped.y0; y < clipped.y1; ++y) {
+    for (int x = clipped.x0; x < clipped.x1; ++x)
+      write_tile(map_data, plane, y * stride + x, value);
+  }
+  refresh_guards(map_data, plane, &clipped);
+  add_dirty_rect(map_data, &clipped);
+}
+
+void map_mark_dirty(map_data_t *map_data, const map_rect_t *rect) {
+  map_rect_t clipped = *rect;
+  if (!clip_rect(map_data, &clipped))
+    return;
+  for (int p = 0; p < NUM_PLANES; ++p) {
+    if (get_plane(map_data, p))
+      refresh_guards(map_data, p, &clipped);
+  }
+  add_dirty_rect(map_data, &clipped);
+}
+
+bool map_add_rebuild_hook(map_data_t *map_data, map_rebuild_fn rebuild, void *user) {
+  if (!rebuild || map_data->_num_rebuild_hooks >= MAP_MAX_REBUILD_HOOKS)
+    return false;
+  map_data->_rebuild_hooks[map_data->_num_rebuild_hooks].rebuild = rebuild;
+  map_data->_rebuild_hooks[map_data->_num_rebuild_hooks].user = user;
+  ++map_data->_num_rebuild_hooks;
+  return true;
+}
+
+void map_remove_rebuild_hook(map_data_t *map_data, map_rebuild_fn rebuild, void *user) {
+  for (int i = 0; i < map_data->_num_rebuild_hooks; ++i) {
+    if (map_data->_rebuild_hooks[i].rebuild == rebuild && map_data->_rebuild_hooks[i].user == user) {
+      memmove(&map_data->_rebuild_hooks[i], &map_data->_rebuild_hooks[i + 1],
+              (map_data->_num_rebuild_hooks - i - 1) * sizeof(map_rebuild_hook_t));
+      --map_data->_num_rebuild_hooks;
+      return;
+    }
+  }
+}
+
+void map_rebuild_dirty(map_data_t *map_data) {
+  const int chunks_x = dirty_chunk_count(map_data->width);
+  unsigned char *dirty = map_data->_dirty_chunks;
+  for (int i = 0; i < map_data->_num_dirty_chunks; ++i) {
+    const int chunk = map_data->_dirty_chunk_list[i];
+    // chunks already passed as part of an earlier run are cleared
+    if (!dirty[chunk])
+      continue;
+    const int cy = chunk / chunks_x;
+    unsigned char *row = dirty + (size_t)cy * chunks_x;
+    int x0 = chunk - cy * chunks_x, x1 = x0 + 1;
+    while (x0 > 0 && row[x0 - 1])
+      --x0;
+    while (x1 < chunks_x && row[x1])
+      ++x1;
+    memset(row + x0, 0, x1 - x0);
+    map_rect_t rect = {x0 << MAP_DIRTY_CHUNK_SHIFT, cy << MAP_DIRTY_CHUNK_SHIFT, x1 << MAP_DIRTY_CHUNK_SHIFT,
+                       (cy + 1) << MAP_DIRTY_CHUNK_SHIFT};
+    if (rect.x1 > map_data->width)
+      rect.x1 = map_data->width;
+    if (rect.y1 > map_data->height)
+      rect.y1 = map_data->height;
+    for (int h = 0; h < map_data->_num_rebuild_hooks; ++h)
+      map_data->_rebuild_hooks[h].rebuild(map_data, &rect, map_data->_rebuild_hooks[h].user);
+  }
+  map_data->_num_dirty_chunks = 0;
+}
+
+static unsigned read_plane_value(const void *plane, int elem_size, size_t index) {
+  if (elem_size == 1)
+    return ((const unsigned char *)plane)[index];
+  return (unsigned short)((const short *)plane)[index];
+}
+
+static void write_block_value(unsigned char *out, int elem_size, unsigned value) {
+  out[0] = value & 0xff;
+  if (elem_size == 2)
+    out[1] = (value >> 8) & 0xff;
+}
+
+static bool compress_plane(compressed_plane_t *out, const void *plane, int elem_size, int width, int height,
+                           int stride, int blocks_x, int blocks_y) {
+  const int num_blocks = blocks_x * blocks_y;
+  out->elem_size = elem_size;
+  out->blocks = malloc(num_blocks * sizeof(unsigned));
+  // worst case every block is stored raw, the buffer is shrunk once the real size is known
+  out->data = malloc((size_t)num_blocks * COMPRESSED_BLOCK_TILES * elem_size + 1);
+  out->data_size = 0;
+  if (!out->blocks || !out->data)
+    return false;
+
+  unsigned values[COMPRESSED_BLOCK_TILES];
+  unsigned palette[16];
+  for (int by = 0; by < blocks_y; ++by) {
+    for (int bx = 0; bx < blocks_x; ++bx) {
+      const int x0 = bx * COMPRESSED_BLOCK_SIZE, y0 = by * COMPRESSED_BLOCK_SIZE;
+      const unsigned first = read_plane_value(plane, elem_size, (size_t)y0 * stride + x0);
+      for (int i = 0; i < COMPRESSED_BLOCK_TILES; ++i) {
+        int x = x0 + (i & (COMPRESSED_BLOCK_SIZE - 1)), y = y0 + (i >> COMPRESSED_BLOCK_SHIFT);
+        values[i] =
+            x < width && y < height ? read_plane_value(plane, elem_size, (size_t)y * stride + x) : first;
+      }
+
+      int num_palette = 0;
+      for (int i = 0; i < COMPRESSED_BLOCK_TILES && num_palette <= 16; ++i) {
+        int p = 0;
+        while (p < num_palette && palette[p] != values[i])
+          ++p;
+        if (p == num_palette && num_palette++ < 16)
+          palette[p] = values[i];
+      }
+
+      unsigned *block = &out->blocks[by * blocks_x + bx];
+      if (num_palette == 1) {
+        *block = first << 4;
+        continue;
+      }
+      if (out->data_size >= (1u << 28))
+        return false;
+      unsigned char *data = out->data + out->data_size;
+      *block = (unsigned)(out->data_size << 4);
+      if (num_palette > 16) {
+        *block |= 8;
+        for (int i = 0; i < COMPRESSED_BLOCK_TILES; ++i)
+          write_block_value(data + i * elem_size, elem_size, values[i]);
+        out->data_size += COMPRESSED_BLOCK_TILES * elem_size;
+        continue;
+      }
+
+      const unsigned bits = num_palette <= 2 ? 1 : num_palette <= 4 ? 2 : 4;
+      *block |= bits;
+      for (int p = 0; p < (1 << bits); ++p)
+        write_block_value(data + p * elem_size, elem_size, p < num_palette ? palette[p] : 0);
+      unsigned char *indices = data + (elem_size << bits);
+      memset(indices, 0, COMPRESSED_BLOCK_TILES * bits / 8);
+      for (int i = 0; i < COMPRESSED_BLOCK_TILES; ++i) {
+        unsigned p = 0;
+        while (palette[p] != values[i])
+          ++p;
+        indices[(i * bits) >> 3] |= p << ((i * bits) & 7);
+      }
+      out->data_size += (elem_size << bits) + COMPRESSED_BLOCK_TILES * bits / 8;
+    }
+  }
+
+  unsigned char *shrunk = realloc(out->data, out->data_size + 1);
+  if (shrunk)
+    out->data = shrunk;
+  return true;
+}
+
+bool compress_map(compressed_map_t *compressed, const map_data_t *map_data) {
+  memset(compressed, 0, sizeof(compressed_map_t));
+  if (!map_data->game_layer.data)
+    return false;
+  compressed->width = map_data->width;
+  compressed->height = map_data->height;
+  compressed->blocks_x = (map_data->width + COMPRESSED_BLOCK_SIZE - 1) / COMPRESSED_BLOCK_SIZE;
+  compressed->blocks_y = (map_data->height + COMPRESSED_BLOCK_SIZE - 1) / COMPRESSED_BLOCK_SIZE;
+  for (int p = 0; p < NUM_PLANES; ++p) {
+    const void *plane = get_plane(map_data, p);
+    if (!plane)
+      continue;
+    if (!compress_plane(&compressed->planes[p], plane, plane_elem_size(p), map_data->width,
+                        map_data->height, map_stride(map_data), compressed->blocks_x, compressed->blocks_y)) {
+      free_compressed_map(compressed);
+      return false;
+    }
+  }
+
+  if (map_data->num_settings > 0) {
+    size_t size = 0;
+    for (int i = 0; i < map_data->num_settings; ++i)
+      size += strlen(map_data->settings[i]) + 1;
+    // the strings share one block with the pointer array
+    compressed->settings = malloc(map_data->num_settings * sizeof(char *) + size);
+    if (!compressed->settings) {
+      free_compressed_map(compressed);
+      return false;
+    }
+    char *next = (char *)(compressed->settings + map_data->num_settings);
+    for (int i = 0; i < map_data->num_settings; ++i) {
+      size_t str_size = strlen(map_data->settings[i]) + 1;
+      memcpy(next, map_data->settings[i], str_size);
+      compressed->settings[i] = next;
+      next += str_size;
+    }
+    compressed->num_settings = map_data->num_settings;
+  }
+  return true;
+}
+
+void compressed_map_decode_block(const compressed_map_t *compressed, int plane, int block_x, int block_y,
+                                 void *out) {
+  const compressed_plane_t *p = &compressed->planes[plane];
+  const unsigned block = p->blocks[block_y * compressed->blocks_x + block_x];
+  const unsigned bits = block & 15;
+  unsigned char *dst = out;
+  if (bits == 0) {
+    if (p->elem_size == 1) {
+      memset(dst, block >> 4, COMPRESSED_BLOCK_TILES);
+    } else {
+      short value = (short)(block >> 4);
+      for (int i = 0; i < COMPRESSED_BLOCK_TILES; ++i)
+        ((short *)out)[i] = value;
+    }
+    return;
+  }
+  const unsigned char *data = p->data + (block >> 4);
+  if (bits > 4) {
+    if (p->elem_size == 1) {
+      memcpy(dst, data, COMPRESSED_BLOCK_TILES);
+    } else {
+      for (int i = 0; i < COMPRESSED_BLOCK_TILES; ++i)
+        ((short *)out)[i] = (short)(data[i * 2] | (data[i * 2 + 1] << 8));
+    }
+    return;
+  }
+  const unsigned char *indices = data + (p->elem_size << bits);
+  const unsigned mask = (1u << bits) - 1;
+  const int per_byte = 8 / bits;
+  if (p->elem_size == 1) {
+    for (int i = 0; i < COMPRESSED_BLOCK_TILES; i += per_byte) {
+      unsigned packed = indices[(i * bits) >> 3];
+      for (int j = 0; j < per_byte; ++j, packed >>= bits)
+        dst[i + j] = data[packed & mask];
+    }
+  } else {
+    for (int i = 0; i < COMPRESSED_BLOCK_TILES; i += per_byte) {
+      unsigned packed = indices[(i * bits) >> 3];
+      for (int j = 0; j < per_byte; ++j, packed >>= bits) {
+        unsigned index = packed & mask;
+        ((short *)out)[i + j] = (short)(data[index * 2] | (data[index * 2 + 1] << 8));
+      }
+    }
+  }
+}
+
+bool decompress_map(const compressed_map_t *compressed, map_data_t *map_data) {
+  reset_map_layers(map_data);
+  const int width = compressed->width, height = compressed->height;
+  short block[COMPRESSED_BLOCK_TILES];
+  for (int p = 0; p < NUM_PLANES; ++p) {
+    if (!compressed->planes[p].blocks)
+      continue;
+    const int elem_size = compressed->planes[p].elem_size;
+    unsigned char *plane = reserve_plane(map_data, p, width, height);
+    if (!plane) {
+      reset_map_layers(map_data);
+      return false;
+    }
+    for (int by = 0; by < compressed->blocks_y; ++by) {
+      for (int bx = 0; bx < compressed->blocks_x; ++bx) {
+        compressed_map_decode_block(compressed, p, bx, by, block);
+        const int x0 = bx * COMPRESSED_BLOCK_SIZE, y0 = by * COMPRESSED_BLOCK_SIZE;
+        const int w = width - x0 < COMPRESSED_BLOCK_SIZE ? width - x0 : COMPRESSED_BLOCK_SIZE;
+        const int h = height - y0 < COMPRESSED_BLOCK_SIZE ? height - y0 : COMPRESSED_BLOCK_SIZE;
+        for (int y = 0; y < h; ++y)
+          memcpy(plane + ((size_t)(y0 + y) * width + x0) * elem_size,
+                 (unsigned char *)block + y * COMPRESSED_BLOCK_SIZE * elem_size, w * elem_size);
+      }
+    }
+    set_plane(map_data, p, plane);
+  }
+  map_data->width = width;
+  map_data->height = height;
+  if (!finish_planes(map_data))
+    return false;
+
+  if (compressed->num_settings > 0) {
+    size_t size = 0;
+    for (int i = 0; i < compressed->num_settings; ++i)
+      size += strlen(compressed->settings[i]) + 1;
+    if (!reserve_buffer((void **)&map_data->_settings_data, &map_data->_settings_data_capacity, size) ||
+        !reserve_buffer((void **)&map_data->_settings_list, &map_data->_settings_list_capacity,
+                        compressed->num_settings * sizeof(char *))) {
+      reset_map_layers(map_data);
+      return false;
+    }
+    char *next = map_data->_settings_data;
+    for (int i = 0; i < compressed->num_settings; ++i) {
+      size_t str_size = strlen(compressed->settings[i]) + 1;
+      memcpy(next, compressed->settings[i], str_size);
+      map_data->_settings_list[i] = next;
+      next += str_size;
+    }
+    map_data->num_settings = compressed->num_settings;
+    map_data->settings = map_data->_settings_list;
+  }
+  return true;
+}
+
+size_t compressed_map_size(const compressed_map_t *compressed) {
+  size_t size = sizeof(compressed_map_t);
+  for (int p = 0; p < NUM_PLANES; ++p) {
+    if (compressed->planes[p].blocks)
+      size +=
+          compressed->blocks_x * compressed->blocks_y * sizeof(unsigned) + compressed->planes[p].data_size;
+  }
+  for (int i = 0; i < compressed->num_settings; ++i)
+    size += sizeof(char *) + strlen(compressed->settings[i]) + 1;
+  return size;
+}
+
+void free_compressed_map(compressed_map_t *compressed) {
+  if (compressed == NULL)
+    return;
+  for (int p = 0; p < NUM_PLANES; ++p) {
+    free(compressed->planes[p].blocks);
+    free(compressed->planes[p].data);
+  }
+  free(compressed->settings);
+  memset(compressed, 0, sizeof(compressed_map_t));
+}
+
+typedef struct component_strip_t {
+  const map_data_t *map_data;
+  map_components_t *out;
+  tile_class_fn classify;
+  void *user;
+  unsigned char *classes;
+  int *parent;
+  int phase;
+  int y0;
+  int y1;
+  int num_roots;
+  int first_id;
+  // components whose root lies in an earlier strip, they all reach into the first row of this one
+  int *foreign_ids;
+  map_component_t *foreign;
+  int num_foreign;
+} component_strip_t;
+
+enum {
+  MAX_COMPONENT_THREADS = 64,
+};
+
+enum {
+  COMPONENT_PHASE_LOCAL = 0,
+  COMPONENT_PHASE_ROOTS,
+  COMPONENT_PHASE_IDS,
+  COMPONENT_PHASE_LABELS,
+};
+
+static int find_root(int *parent, int i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+static int find_root_readonly(const int *parent, int i) {
+  while (parent[i] != i)
+    i = parent[i];
+  return i;
+}
+
+// the smaller index always becomes the root, so a root is the first tile of its component
+static void union_roots(int *parent, int a, int b) {
+  a = find_root(parent, a);
+  b = find_root(parent, b);
+  if (a < b)
+    parent[b] = a;
+  else if (b < a)
+    parent[a] = b;
+}
+
+static void add_component_tile(map_component_t *component, int x, int y) {
+  if (component->num_tiles++ == 0) {
+    component->min_x = component->max_x = x;
+    component->min_y = component->max_y = y;
+    return;
+  }
+  if (x < component->min_x)
+    component->min_x = x;
+  if (x > component->max_x)
+    component->max_x = x;
+  if (y < component->min_y)
+    component->min_y = y;
+  if (y > component->max_y)
+    component->max_y = y;
+}
+
+static int compare_ints(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+static void component_strip_local(component_strip_t *strip) {
+  const int width = strip->map_data->width, stride = map_stride(strip->map_data);
+  unsigned char *classes = strip->classes;
+  int *parent = strip->parent;
+  for (int y = strip->y0; y < strip->y1; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const int i = y * width + x;
+      const int c = strip->classify(strip->map_data, y * stride + x, strip->user);
+      classes[i] = c;
+      parent[i] = i;
+      if (!c)
+        continue;
+      if (x > 0 && classes[i - 1] == c)
+        union_roots(parent, i, i - 1);
+      if (y > strip->y0 && classes[i - width] == c)
+        union_roots(parent, i, i - width);
+    }
+  }
+}
+
+static void component_strip_roots(component_strip_t *strip) {
+  const int width = strip->map_data->width;
+  const unsigned char *classes = strip->classes;
+  int *labels = strip->out->labels;
+  strip->num_roots = 0;
+  for (int i = strip->y0 * width; i < strip->y1 * width; ++i) {
+    if (!classes[i])
+      continue;
+    // a run of the same class shares its root, only the first tile has to walk the tree
+    if (i % width > 0 && classes[i - 1] == classes[i])
+      labels[i] = labels[i - 1];
+    else
+      labels[i] = find_root_readonly(strip->parent, i);
+    if (labels[i] == i)
+      ++strip->num_roots;
+  }
+}
+
+static void component_strip_ids(component_strip_t *strip) {
+  const int width = strip->map_data->width;
+  const int *labels = strip->out->labels;
+  int id = strip->first_id;
+  for (int i = strip->y0 * width; i < strip->y1 * width; ++i) {
+    if (strip->classes[i] && labels[i] == i) {
+      strip->parent[i] = id;
+      strip->out->components[id].tile_class = strip->classes[i];
+      strip->out->components[id].num_tiles = 0;
+      ++id;
+    }
+  }
+}
+
+static void component_strip_labels(component_strip_t *strip) {
+  const int width = strip->map_data->width;
+  const unsigned char *classes = strip->classes;
+  const int *parent = strip->parent;
+  int *labels = strip->out->labels;
+  map_component_t *components = strip->out->components;
+
+  strip->num_foreign = 0;
+  for (int i = strip->y0 * width; i < (strip->y0 + 1) * width; ++i) {
+    if (classes[i] && parent[labels[i]] < strip->first_id)
+      strip->foreign_ids[strip->num_foreign++] = parent[labels[i]];
+  }
+  qsort(strip->foreign_ids, strip->num_foreign, sizeof(int), compare_ints);
+  int num_unique = 0;
+  for (int f = 0; f < strip->num_foreign; ++f) {
+    if (num_unique == 0 || strip->foreign_ids[num_unique - 1] != strip->foreign_ids[f])
+      strip->foreign_ids[num_unique++] = strip->foreign_ids[f];
+  }
+  strip->num_foreign = num_unique;
+  memset(strip->foreign, 0, num_unique * sizeof(map_component_t));
+
+  int last_id = -1;
+  map_component_t *last = NULL;
+  for (int y = strip->y0; y < strip->y1; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const int i = y * width + x;
+      if (!classes[i]) {
+        labels[i] = 0;
+        continue;
+      }
+      const int id = parent[labels[i]];
+      labels[i] = id + 1;
+      if (id != last_id) {
+        last_id = id;
+        if (id >= strip->first_id) {
+          last = &components[id];
+        } else {
+          const int *found = bsearch(&id, strip->foreign_ids, strip->num_foreign, sizeof(int), compare_ints);
+          last = &strip->foreign[found - strip->foreign_ids];
+        }
+      }
+      add_component_tile(last, x, y);
+    }
+  }
+}
+
+static void run_component_phase(component_strip_t *strip) {
+  switch (strip->phase) {
+  case COMPONENT_PHASE_LOCAL:
+    component_strip_local(strip);
+    break;
+  case COMPONENT_PHASE_ROOTS:
+    component_strip_roots(strip);
+    break;
+  case COMPONENT_PHASE_IDS:
+    component_strip_ids(strip);
+    break;
+  case COMPONENT_PHASE_LABELS:
+    component_strip_labels(strip);
+    break;
+  }
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI component_thread(LPVOID data) {
+  run_component_phase(data);
+  return 0;
+}
+#else
+static void *component_thread(void *data) {
+  run_component_phase(data);
+  return NULL;
+}
+#endif
+
+// runs one phase on every strip, the calling thread takes the first strip
+static void run_component_strips(component_strip_t *strips, int num_strips, int phase) {
+  for (int s = 0; s < num_strips; ++s)
+    strips[s].phase = phase;
+#if defined(_WIN32)
+  HANDLE threads[MAX_COMPONENT_THREADS];
+  for (int s = 1; s < num_strips; ++s) {
+    threads[s] = CreateThread(NULL, 0, component_thread, &strips[s], 0, NULL);
+    if (!threads[s])
+      run_component_phase(&strips[s]);
+  }
+  run_component_phase(&strips[0]);
+  for (int s = 1; s < num_strips; ++s) {
+    if (threads[s]) {
+      WaitForSingleObject(threads[s], INFINITE);
+      CloseHandle(threads[s]);
+    }
+  }
+#else
+  pthread_t threads[MAX_COMPONENT_THREADS];
+  bool started[MAX_COMPONENT_THREADS] = {false};
+  for (int s = 1; s < num_strips; ++s) {
+    started[s] = pthread_create(&threads[s], NULL, component_thread, &strips[s]) == 0;
+    if (!started[s])
+      run_component_phase(&strips[s]);
+  }
+  run_component_phase(&strips[0]);
+  for (int s = 1; s < num_strips; ++s) {
+    if (started[s])
+      pthread_join(threads[s], NULL);
+  }
+#endif
+}
+
+static int count_cores(void) {
+#if defined(_WIN32)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#else
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? (int)cores : 1;
+#endif
+}
+
+bool label_map_components(map_components_t *components, const map_data_t *map_data, tile_class_fn classify,
+                          void *user, int num_threads) {
+  memset(components, 0, sizeof(map_components_t));
+  if (!map_data->game_layer.data || !classify)
+    return false;
+  const int width = map_data->width, height = map_data->height;
+  const size_t size = (size_t)width * height;
+
+  if (num_threads <= 0)
+    num_threads = count_cores();
+  if (num_threads > MAX_COMPONENT_THREADS)
+    num_threads = MAX_COMPONENT_THREADS;
+  if (num_threads > height)
+    num_threads = height;
+
+  component_strip_t strips[MAX_COMPONENT_THREADS];
+  unsigned char *classes = malloc(size);
+  int *parent = malloc(size * sizeof(int));
+  int *foreign_ids = malloc((size_t)num_threads * width * sizeof(int));
+  map_component_t *foreign = malloc((size_t)num_threads * width * sizeof(map_component_t));
+  components->labels = malloc(size * sizeof(int));
+  bool result = false;
+  if (!classes || !parent || !foreign_ids || !foreign || !components->labels)
+    goto cleanup;
+  components->width = width;
+  components->height = height;
+
+  for (int s = 0; s < num_threads; ++s) {
+    strips[s].map_data = map_data;
+    strips[s].out = components;
+    strips[s].classify = classify;
+    strips[s].user = user;
+    strips[s].classes = classes;
+    strips[s].parent = parent;
+    strips[s].y0 = (int)((long long)height * s / num_threads);
+    strips[s].y1 = (int)((long long)height * (s + 1) / num_threads);
+    strips[s].foreign_ids = foreign_ids + (size_t)s * width;
+    strips[s].foreign = foreign + (size_t)s * width;
+  }
+
+  run_component_strips(strips, num_threads, COMPONENT_PHASE_LOCAL);
+  // stitching the strips together only touches one row per strip
+  for (int s = 1; s < num_threads; ++s) {
+    for (int i = strips[s].y0 * width; i < (strips[s].y0 + 1) * width; ++i) {
+      if (classes[i] && classes[i - width] == classes[i])
+        union_roots(parent, i, i - width);
+    }
+  }
+
+  run_component_strips(strips, num_threads, COMPONENT_PHASE_ROOTS);
+  for (int s = 0; s < num_threads; ++s) {
+    strips[s].first_id = components->num_components;
+    components->num_components += strips[s].num_roots;
+  }
+  components->components = malloc((components->num_components + 1) * sizeof(map_component_t));
+  if (!components->components)
+    goto cleanup;
+
+  run_component_strips(strips, num_threads, COMPONENT_PHASE_IDS);
+  run_component_strips(strips, num_threads, COMPONENT_PHASE_LABELS);
+  for (int s = 1; s < num_threads; ++s) {
+    for (int f = 0; f < strips[s].num_foreign; ++f) {
+      map_component_t *component = &components->components[strips[s].foreign_ids[f]];
+      const map_component_t *part = &strips[s].foreign[f];
+      if (!part->num_tiles)
+        continue;
+      add_component_tile(component, part->min_x, part->min_y);
+      add_component_tile(component, part->max_x, part->max_y);
+      component->num_tiles += part->num_tiles - 2;
+    }
+  }
+  result = true;
+
+cleanup:
+  free(classes);
+  free(parent);
+  free(foreign_ids);
+  free(foreign);
+  if (!result)
+    free_map_components(components);
+  return result;
+}
+
+void free_map_components(map_components_t *components) {
+  if (components == NULL)
+    return;
+  free(components->labels);
+  free(components->components);
+  memset(components, 0, sizeof(map_components_t));
+}
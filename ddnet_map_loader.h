@@ -152,6 +152,69 @@ enum {
   ENTITY_OFFSET = 255 - 16 * 4,
 };
 
+// per-tile planes owned by map_data_t, in the order they are stored internally
+enum {
+  PLANE_GAME_DATA = 0,
+  PLANE_GAME_FLAGS,
+  PLANE_FRONT_DATA,
+  PLANE_FRONT_FLAGS,
+  PLANE_TELE_NUMBER,
+  PLANE_TELE_TYPE,
+  PLANE_SPEEDUP_FORCE,
+  PLANE_SPEEDUP_MAX_SPEED,
+  PLANE_SPEEDUP_TYPE,
+  PLANE_SPEEDUP_ANGLE,
+  PLANE_SWITCH_NUMBER,
+  PLANE_SWITCH_TYPE,
+  PLANE_SWITCH_FLAGS,
+  PLANE_SWITCH_DELAY,
+  PLANE_TUNE_NUMBER,
+  PLANE_TUNE_TYPE,
+  NUM_PLANES,
+};
+
+// flags for map_data_t.load_flags
+enum {
+  LOAD_MAP_HASHES = 1 << 0,
+};
+
+// Optional padded plane layout, used when border > 0 or alignment > 1. Every plane gets border guard
+// tiles on each side and rows of stride tiles, so tiles up to border outside the map can be read
+// without bounds checks and whole rows can be read with vector loads.
+typedef struct map_padding_t {
+  int border;
+  // the row stride is rounded up to a multiple of this many tiles
+  int alignment;
+  // guard tiles repeat the nearest map tile like DDNet's collision clamps positions,
+  // otherwise they are set to fill, e.g. fill[PLANE_GAME_DATA] = TILE_SOLID
+  bool clamp;
+  int fill[NUM_PLANES];
+} map_padding_t;
+
+// x1 and y1 are exclusive
+typedef struct map_rect_t {
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+} map_rect_t;
+
+struct map_data_t;
+// Updates data derived from the map for one changed region, see map_rebuild_dirty(). Hooks only read
+// the map, they must not edit it or add and remove hooks.
+typedef void (*map_rebuild_fn)(const struct map_data_t *map_data, const map_rect_t *rect, void *user);
+
+typedef struct map_rebuild_hook_t {
+  map_rebuild_fn rebuild;
+  void *user;
+} map_rebuild_hook_t;
+
+enum {
+  MAP_DIRTY_CHUNK_SHIFT = 4,
+  MAP_DIRTY_CHUNK_SIZE = 1 << MAP_DIRTY_CHUNK_SHIFT,
+  MAP_MAX_REBUILD_HOOKS = 8,
+};
+
 typedef struct game_layer_t {
   unsigned char *data;
   unsigned char *flags;
@@ -191,6 +254,9 @@ typedef struct map_data_t {
   game_layer_t game_layer;
   int width;
   int height;
+  // distance between rows of every plane, equals width unless padding is used
+  int stride;
+  int border;
   game_layer_t front_layer;
   tele_layer_t tele_layer;
   speedup_layer_t speedup_layer;
@@ -200,13 +266,166 @@ typedef struct map_data_t {
   int num_settings;
   char **settings;
 
+  // LOAD_MAP_* flags and padding, set before load_map_into() and kept between loads
+  int load_flags;
+  map_padding_t padding;
+  // CRC32 and SHA-256 of the map file as advertised to clients, filled with LOAD_MAP_HASHES
+  bool has_hashes;
+  unsigned crc;
+  unsigned char sha256[32];
+
   // internal data
+  // one flag per dirty chunk and the chunks in the order they became dirty, sized at load
+  unsigned char *_dirty_chunks;
+  size_t _dirty_chunks_capacity;
+  int *_dirty_chunk_list;
+  size_t _dirty_chunk_list_capacity;
+  int _num_dirty_chunks;
+  map_rebuild_hook_t _rebuild_hooks[MAP_MAX_REBUILD_HOOKS];
+  int _num_rebuild_hooks;
+
   void *_map_file_data;
   size_t _map_file_size;
+  size_t _map_file_capacity;
+
+  // buffers kept alive between load_map_into() calls, only grown when a map needs more
+  void *_planes[NUM_PLANES];
+  size_t _plane_capacities[NUM_PLANES];
+  void *_inflate_buffer;
+  size_t _inflate_capacity;
+  // z_stream initialized once and reset for every item, so zlib keeps its state allocation
+  void *_inflate_stream;
+  void *_info_buffer;
+  size_t _info_capacity;
+  char **_settings_list;
+  size_t _settings_list_capacity;
+  char *_settings_data;
+  size_t _settings_data_capacity;
 } map_data_t;
 
+// Tile access without bounds checks. Coordinates may lie up to border tiles outside the map.
+#define MAP_INDEX(map_data, x, y) ((y) * (map_data)->stride + (x))
+#define MAP_TILE(map_data, plane, x, y) ((plane)[MAP_INDEX(map_data, x, y)])
+#define MAP_GAME_TILE(map_data, x, y) MAP_TILE(map_data, (map_data)->game_layer.data, x, y)
+#define MAP_FRONT_TILE(map_data, x, y) MAP_TILE(map_data, (map_data)->front_layer.data, x, y)
+
 map_data_t load_map(const char *name);
 map_data_t load_map_from_memory(unsigned char *buffer, size_t size);
+
+// Loads a map into an existing map_data_t, reusing the buffers of a previous load.
+// map_data must be zero-initialized or the result of an earlier load. On failure the
+// layers are left empty but the buffers stay allocated until free_map_data().
+bool load_map_into(map_data_t *map_data, const char *name);
+// Same as load_map_into(), the buffer is only read during the call and stays owned by the caller.
+bool load_map_from_memory_into(map_data_t *map_data, const unsigned char *buffer, size_t size);
 void free_map_data(map_data_t *map_data);
 
+// Runtime edits. Changed tiles mark the MAP_DIRTY_CHUNK_SIZE square chunks they lie in as dirty until
+// map_rebuild_dirty() passes them to the rebuild hooks. Every chunk of the map can be dirty at once, so
+// scattered edits are never merged into a bounding box. The worst case is one changed tile per chunk,
+// which rebuilds MAP_DIRTY_CHUNK_SIZE^2 tiles for each edit.
+// A load marks the whole map dirty. Hooks are kept between loads.
+bool map_set_tile(map_data_t *map_data, int plane, int x, int y, int value);
+// Sets every tile of the rectangle, clipped to the map.
+void map_fill_tiles(map_data_t *map_data, int plane, const map_rect_t *rect, int value);
+// For callers that write into the planes directly.
+void map_mark_dirty(map_data_t *map_data, const map_rect_t *rect);
+bool map_add_rebuild_hook(map_data_t *map_data, map_rebuild_fn rebuild, void *user);
+void map_remove_rebuild_hook(map_data_t *map_data, map_rebuild_fn rebuild, void *user);
+// Calls every hook for each horizontal run of dirty chunks, clipped to the map, and clears them. Runs
+// never overlap, so every dirty tile is passed to a hook exactly once.
+void map_rebuild_dirty(map_data_t *map_data);
+
+// Compressed storage for keeping many maps resident. Every plane is cut into 8x8 tile blocks.
+// A block is either a single value, a palette of 2, 4 or 16 entries with 1, 2 or 4 bit indices,
+// or the raw values. Each block has one index word, so a single tile is read in O(1).
+enum {
+  COMPRESSED_BLOCK_SHIFT = 3,
+  COMPRESSED_BLOCK_SIZE = 1 << COMPRESSED_BLOCK_SHIFT,
+  COMPRESSED_BLOCK_TILES = COMPRESSED_BLOCK_SIZE * COMPRESSED_BLOCK_SIZE,
+};
+
+typedef struct compressed_plane_t {
+  // low 4 bits: 0 = uniform, 1/2/4 = palette with that many bits per tile, 8 = raw values
+  // high 28 bits: the value of a uniform block or the offset of the block in data
+  unsigned *blocks;
+  unsigned char *data;
+  size_t data_size;
+  int elem_size;
+} compressed_plane_t;
+
+typedef struct compressed_map_t {
+  int width;
+  int height;
+  int blocks_x;
+  int blocks_y;
+  // blocks is NULL for planes of layers the map does not have
+  compressed_plane_t planes[NUM_PLANES];
+  int num_settings;
+  char **settings;
+} compressed_map_t;
+
+bool compress_map(compressed_map_t *compressed, const map_data_t *map_data);
+// Decompresses into map_data, reusing its buffers like load_map_into().
+bool decompress_map(const compressed_map_t *compressed, map_data_t *map_data);
+// Writes the COMPRESSED_BLOCK_TILES values of one block to out, which holds elem_size bytes per tile.
+// Tiles of edge blocks outside the map repeat the first tile of the block.
+void compressed_map_decode_block(const compressed_map_t *compressed, int plane, int block_x, int block_y,
+                                 void *out);
+size_t compressed_map_size(const compressed_map_t *compressed);
+void free_compressed_map(compressed_map_t *compressed);
+
+// Connected regions of tiles with the same class, using 4-connectivity. The class function is called
+// once per tile from several threads at once with the plane index of the tile (MAP_INDEX) and returns
+// 0 for tiles that should not be labelled or a class in 1..255.
+typedef int (*tile_class_fn)(const map_data_t *map_data, int index, void *user);
+
+typedef struct map_component_t {
+  int tile_class;
+  int num_tiles;
+  int min_x;
+  int min_y;
+  int max_x;
+  int max_y;
+} map_component_t;
+
+typedef struct map_components_t {
+  int width;
+  int height;
+  // component index + 1 for every tile, 0 for tiles of class 0, rows are width tiles without padding
+  int *labels;
+  int num_components;
+  map_component_t *components;
+} map_components_t;
+
+// Labels the map in horizontal strips, one per thread. num_threads <= 0 uses all cores.
+bool label_map_components(map_components_t *components, const map_data_t *map_data, tile_class_fn classify,
+                          void *user, int num_threads);
+void free_map_components(map_components_t *components);
+
+// No bounds checks, x and y have to be inside the map and the plane has to exist.
+static inline int compressed_map_get_tile(const compressed_map_t *compressed, int plane, int x, int y) {
+  const compressed_plane_t *p = &compressed->planes[plane];
+  unsigned block =
+      p->blocks[(y >> COMPRESSED_BLOCK_SHIFT) * compressed->blocks_x + (x >> COMPRESSED_BLOCK_SHIFT)];
+  unsigned bits = block & 15;
+  unsigned value;
+  if (bits == 0) {
+    value = block >> 4;
+  } else {
+    const unsigned char *data = p->data + (block >> 4);
+    const int mask = COMPRESSED_BLOCK_SIZE - 1;
+    unsigned i = ((y & mask) << COMPRESSED_BLOCK_SHIFT) | (x & mask);
+    if (bits <= 4) {
+      const unsigned char *indices = data + (p->elem_size << bits);
+      unsigned index = (indices[(i * bits) >> 3] >> ((i * bits) & 7)) & ((1u << bits) - 1);
+      i = index;
+    }
+    if (p->elem_size == 1)
+      return data[i];
+    value = data[i * 2] | (data[i * 2 + 1] << 8);
+  }
+  return p->elem_size == 1 ? (int)value : (int)(short)value;
+}
+
 #endif